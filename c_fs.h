@@ -1,5 +1,12 @@
 #define _GNU_SOURCE
 #include <assert.h>
+// dirent's DIR would clash with the DIR node type
+#define DIR HOST_DIR
+#include <dirent.h>
+#undef DIR
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,11 +14,39 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BLOCK_SIZE 4096
 #define MAX_NAME_LENGTH 64
-#define MAX_FD 1024
+// File descriptors hold the table index in their low bits and the slot generation above it
+#define FD_INDEX_BITS 24
+#define MAX_FD ((size_t)1 << FD_INDEX_BITS)
+#define INVALID_FD ((size_t)-1)
+#define MAX_STRIPES 16
+// Address space reserved up front for a striped volume, so its mapping never moves
+#define MAX_VOLUME_SIZE ((size_t)1 << 40)
+// Every backing file of a striped volume starts with a StripeHeader padded to a block
+#define STRIPE_HEADER_SIZE BLOCK_SIZE
+#define STRIPE_MAGIC 0x5049525453424d44
+// Every stripe unit is its own mapping, these are left under vm.max_map_count for everything else
+#define MAP_COUNT_RESERVE 1024
+#define DEFAULT_MAX_MAP_COUNT 65530
+// Reads and writes spanning at least this many blocks copy each stripe on its own thread
+#define STRIPE_PARALLEL_BLOCKS 256
+// Readahead window of a sequential stream, in blocks
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 256
+// Consecutive reads that have to agree before an fd switches access pattern
+#define ACCESS_CONFIRM 2
+
+// Flags for set_mapping_hints
+#define MAPPING_HINT_METADATA 1
+#define MAPPING_HINT_POPULATE 2
+#define MAPPING_HINT_HUGEPAGES 4
 
 #define MAP_OFFSET(off, ptr) (size_t)((char*)(ptr) - (size_t)(off))
 #define OUT_OFFSET(off, ptr) (void*)((char*)(off) + (ptr))
@@ -44,7 +79,7 @@ typedef struct {
     NodeOffset next_node;
 } EmptyNode;
 
-#define MAX_NODE_COUNT (BLOCK_SIZE - sizeof(void*) - sizeof(size_t)) / sizeof(Node)
+#define MAX_NODE_COUNT ((BLOCK_SIZE - sizeof(void*) - sizeof(size_t)) / sizeof(Node))
 
 // There are blocks that hold data and others that only hold nodes
 typedef struct {
@@ -53,7 +88,7 @@ typedef struct {
     Node nodes[];
 } NodeBlock;
 
-#define MAX_DATA_CAPACITY (BLOCK_SIZE - sizeof(void*)) / sizeof(char)
+#define MAX_DATA_CAPACITY ((BLOCK_SIZE - sizeof(void*)) / sizeof(char))
 
 typedef struct {
     BlockOffset next_block;
@@ -75,20 +110,85 @@ typedef struct {
     NodeOffset first_free_block;
     NodeOffset root_dir;
     NodeOffset first_block;
+    // Only set on striped volumes, the stripe unit is in blocks
+    size_t stripe_count;
+    size_t stripe_unit;
+    size_t volume_blocks;
 } RootNode;
 
+typedef enum { ACCESS_UNKNOWN, ACCESS_SEQUENTIAL, ACCESS_STRIDED, ACCESS_RANDOM } AccessPattern;
+
 typedef struct {
     int in_use;
+    unsigned generation;
     NodeOffset file;
     size_t offset;
+
+    // Last block read and its index in the file, so sequential reads don't rewalk the chain
+    BlockOffset cursor_block;
+    size_t cursor_index;
+
+    // Access pattern detection, offsets are those of the previous read
+    AccessPattern pattern;
+    AccessPattern candidate;
+    size_t hits;
+    size_t last_offset;
+    size_t last_end;
+    long stride;
+    size_t window;
+    size_t prefetched_to;
+    // Set once a hop between blocks that aren't neighbours is seen
+    int fragmented;
+    // Highest block index read so far, every hop up to it has been checked
+    size_t walked_to;
+    // Blocks given MADV_RANDOM for this fd, undone when it leaves random mode or is closed
+    BlockOffset random_start;
+    size_t random_blocks;
+    size_t random_epoch;
 } FD;
 
+// Closed slots are kept on a stack so both open and close are O(1)
+typedef struct {
+    FD* entries;
+    size_t* free_slots;
+    size_t free_count;
+    size_t count;
+    size_t capacity;
+} FDTable;
+
+typedef struct {
+    int file;
+    size_t num_units;
+} Stripe;
+
+// Says which volume a backing file belongs to and where it goes, so files passed in the
+// wrong order or from another volume are caught before anything is mapped
+typedef struct {
+    size_t magic;
+    size_t volume_id;
+    size_t stripe_index;
+    size_t stripe_count;
+    size_t stripe_unit;
+} StripeHeader;
+
 typedef struct {
     int file;
     long file_size;
     size_t num_blocks;
     RootNode* root;
-    FD fd_table[MAX_FD];
+    // Zero for a plain single file image
+    size_t stripe_count;
+    size_t stripe_unit;
+    size_t num_units;
+    // Units the volume may grow to before running out of mappings or reserved space
+    size_t max_units;
+    Stripe stripes[MAX_STRIPES];
+    int readahead;
+    int hints;
+    // MADV_RANDOM splits the mapping, so it is cleared before mremap and advice_epoch bumped
+    int random_advised;
+    size_t advice_epoch;
+    FDTable fd_table;
 } Mapper;
 
 typedef struct DirIterator {
@@ -96,6 +196,15 @@ typedef struct DirIterator {
     NodeOffset node;
 } DirIterator;
 
+size_t min(size_t a, size_t b) {
+    if (a < b) return a;
+    return b;
+}
+
+size_t blocks_for_size(size_t size) {
+    return (size + MAX_DATA_CAPACITY - 1) / MAX_DATA_CAPACITY;
+}
+
 void insert_node(Mapper* mapper, Node* node, Node* insert) {
     NodeOffset next_sibling = insert->next_sibling;
     insert->next_sibling = MAP_OFFSET(mapper->root, node);
@@ -104,6 +213,23 @@ void insert_node(Mapper* mapper, Node* node, Node* insert) {
 
 NodeOffset get_node(Mapper* mapper);
 
+void init_root(Mapper* mapper) {
+    mapper->root->type = ROOT;
+    mapper->root->first_free_block = NULL_OFF;
+    mapper->root->first_free_node = NULL_OFF;
+
+    // Can't access root directly from here, since this may move it
+    NodeOffset rd = get_node(mapper);
+    Node* root_dir = (Node*)OUT_OFFSET(mapper->root, rd);
+    root_dir->type = DIR;
+    root_dir->name[0] = 0;
+    root_dir->node.dir.first_child = NULL_OFF;
+    root_dir->next_sibling = NULL_OFF;
+    root_dir->parent = NULL_OFF;
+
+    mapper->root->root_dir = rd;
+}
+
 Mapper* new_mapper(char* filename) {
     Mapper* mapper = (Mapper*)calloc(1, sizeof(Mapper));
     int fd = open(filename, O_RDWR | O_CREAT, 0666);
@@ -112,6 +238,7 @@ Mapper* new_mapper(char* filename) {
         exit(1);
     }
     mapper->file = fd;
+    mapper->readahead = 1;
     mapper->file_size = lseek(fd, 0, SEEK_END);
     mapper->num_blocks = mapper->file_size / BLOCK_SIZE;
     int file_empty = mapper->num_blocks == 0;
@@ -133,21 +260,186 @@ Mapper* new_mapper(char* filename) {
     // Needed for get_node
     mapper->root = root;
     if (file_empty) {
-        root->type = ROOT;
-        root->first_free_block = NULL_OFF;
-        root->first_free_node = NULL_OFF;
+        init_root(mapper);
+    }
+    return mapper;
+}
+
+// Striped volumes keep BlockOffset logical. Logical block i belongs to stripe unit
+// i / stripe_unit, and units are dealt round robin over the backing files, so
+// unit k lives in stripe k % stripe_count at unit k / stripe_count of that file.
+size_t block_stripe(Mapper* mapper, BlockOffset b) {
+    if (mapper->stripe_count == 0) return 0;
+    return (b / BLOCK_SIZE / mapper->stripe_unit) % mapper->stripe_count;
+}
+
+// Offset of b in its backing file, past the file's header
+off_t block_stripe_offset(Mapper* mapper, BlockOffset b) {
+    if (mapper->stripe_count == 0) return b;
+    size_t block = b / BLOCK_SIZE;
+    size_t unit = block / mapper->stripe_unit;
+    size_t local_unit = unit / mapper->stripe_count;
+    return STRIPE_HEADER_SIZE + (off_t)(local_unit * mapper->stripe_unit + block % mapper->stripe_unit) * BLOCK_SIZE;
+}
+
+// Maps unit k of a striped volume into its fixed place in the reserved region
+int map_stripe_unit(Mapper* mapper, size_t k) {
+    size_t unit_size = mapper->stripe_unit * BLOCK_SIZE;
+    BlockOffset b = k * unit_size;
+    Stripe* stripe = &mapper->stripes[block_stripe(mapper, b)];
+    off_t file_offset = block_stripe_offset(mapper, b);
+    if (file_offset + unit_size > STRIPE_HEADER_SIZE + stripe->num_units * unit_size) {
+        if (ftruncate(stripe->file, file_offset + unit_size) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+        stripe->num_units = (file_offset + unit_size - STRIPE_HEADER_SIZE) / unit_size;
+    }
+    void* addr = mmap(OUT_OFFSET(mapper->root, b), unit_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, stripe->file, file_offset);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    // Advising whole units keeps them from being split into more mappings
+    if (mapper->hints & MAPPING_HINT_HUGEPAGES) {
+        madvise(addr, unit_size, MADV_HUGEPAGE);
+    }
+    return 0;
+}
+
+// How many stripe units a volume may have. It only depends on vm.max_map_count, so a volume
+// grown to the limit by one process can still be opened by the next.
+size_t stripe_unit_budget(size_t unit_size) {
+    size_t max_map_count = DEFAULT_MAX_MAP_COUNT;
+    FILE* f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%zu", &max_map_count) != 1) max_map_count = DEFAULT_MAX_MAP_COUNT;
+        fclose(f);
+    }
+    size_t budget = max_map_count > MAP_COUNT_RESERVE ? max_map_count - MAP_COUNT_RESERVE : 0;
+    return min(budget, MAX_VOLUME_SIZE / unit_size);
+}
+
+Mapper* new_striped_mapper(char** filenames, size_t count, size_t stripe_unit) {
+    if (count == 0 || count > MAX_STRIPES || stripe_unit == 0) {
+        puts("invalid stripe geometry");
+        exit(1);
+    }
+    Mapper* mapper = (Mapper*)calloc(1, sizeof(Mapper));
+    mapper->stripe_count = count;
+    mapper->stripe_unit = stripe_unit;
+    mapper->readahead = 1;
+    size_t unit_size = stripe_unit * BLOCK_SIZE;
+    size_t total_units = 0;
+    size_t empty = 0;
+    size_t volume_id = 0;
+    size_t first_header = count;
+    for (size_t i = 0; i < count; i++) {
+        int fd = open(filenames[i], O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            perror(filenames[i]);
+            exit(1);
+        }
+        mapper->stripes[i].file = fd;
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size == 0) {
+            empty++;
+            continue;
+        }
+        StripeHeader header;
+        if (size < STRIPE_HEADER_SIZE || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+                || header.magic != STRIPE_MAGIC) {
+            printf("%s is not a backing file of a striped volume\n", filenames[i]);
+            exit(1);
+        }
+        if (first_header == count) {
+            first_header = i;
+            volume_id = header.volume_id;
+        }
+        if (header.volume_id != volume_id) {
+            printf("%s belongs to a different volume than %s\n", filenames[i], filenames[first_header]);
+            exit(1);
+        }
+        if (header.stripe_count != count || header.stripe_unit != stripe_unit) {
+            printf("volume was created with %zu stripes of %zu blocks\n", header.stripe_count, header.stripe_unit);
+            exit(1);
+        }
+        if (header.stripe_index != i) {
+            printf("%s is stripe %zu of the volume but was passed as stripe %zu\n",
+                    filenames[i], header.stripe_index, i);
+            exit(1);
+        }
+        if ((size - STRIPE_HEADER_SIZE) % unit_size != 0) {
+            printf("%s is not a whole number of stripe units\n", filenames[i]);
+            exit(1);
+        }
+        mapper->stripes[i].num_units = (size - STRIPE_HEADER_SIZE) / unit_size;
+        total_units += mapper->stripes[i].num_units;
+    }
+    if (empty != 0 && empty != count) {
+        puts("some backing files are empty but the others already hold a volume");
+        exit(1);
+    }
+    if (empty == count) {
+        StripeHeader header = { .magic = STRIPE_MAGIC, .stripe_count = count, .stripe_unit = stripe_unit };
+        if (getrandom(&header.volume_id, sizeof(header.volume_id), 0) != sizeof(header.volume_id)) {
+            header.volume_id = (size_t)time(NULL) ^ ((size_t)getpid() << 32);
+        }
+        for (size_t i = 0; i < count; i++) {
+            header.stripe_index = i;
+            if (ftruncate(mapper->stripes[i].file, STRIPE_HEADER_SIZE) == -1
+                    || pwrite(mapper->stripes[i].file, &header, sizeof(header), 0) != sizeof(header)) {
+                perror(filenames[i]);
+                exit(1);
+            }
+        }
+    }
+    // Units are dealt round robin, so the files can only differ by one unit
+    for (size_t i = 0; i < count; i++) {
+        size_t expected = total_units / count + (i < total_units % count);
+        if (mapper->stripes[i].num_units != expected) {
+            puts("backing files don't belong to the same volume");
+            exit(1);
+        }
+    }
+    mapper->file = mapper->stripes[0].file;
 
-        // Can't access root directly from here, since this may move it
-        NodeOffset rd = get_node(mapper);
-        Node* root_dir = (Node*)OUT_OFFSET(mapper->root, rd);
-        root_dir->type = DIR;
-        root_dir->name[0] = 0;
-        root_dir->node.dir.first_child = NULL_OFF;
-        root_dir->next_sibling = NULL_OFF;
-        root_dir->parent = NULL_OFF;
+    void* region = mmap(0, MAX_VOLUME_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    mapper->root = (RootNode*)region;
+    int volume_empty = total_units == 0;
+    if (volume_empty) total_units = 1;
+    mapper->max_units = stripe_unit_budget(unit_size);
+    if (total_units > mapper->max_units) {
+        printf("volume needs %zu mappings, vm.max_map_count allows %zu\n",
+                total_units, mapper->max_units);
+        exit(1);
+    }
+    for (size_t k = 0; k < total_units; k++) {
+        if (map_stripe_unit(mapper, k) == -1) exit(1);
+    }
+    mapper->num_units = total_units;
 
-        mapper->root->root_dir = rd;
+    if (volume_empty) {
+        mapper->num_blocks = 1;
+        mapper->file_size = BLOCK_SIZE;
+        mapper->root->stripe_count = count;
+        mapper->root->stripe_unit = stripe_unit;
+        mapper->root->volume_blocks = 1;
+        init_root(mapper);
+        return mapper;
+    }
+    if (mapper->root->stripe_count != count || mapper->root->stripe_unit != stripe_unit) {
+        printf("volume was created with %zu stripes of %zu blocks\n",
+                mapper->root->stripe_count, mapper->root->stripe_unit);
+        exit(1);
     }
+    mapper->num_blocks = mapper->root->volume_blocks;
+    mapper->file_size = mapper->num_blocks * BLOCK_SIZE;
     return mapper;
 }
 
@@ -166,14 +458,34 @@ BlockOffset get_first_empty_block(RootNode* root) {
     return b;
 }
 
-BlockOffset get_block(Mapper* mapper) {
-    BlockOffset block = get_first_empty_block(mapper->root);
-    if (block != NULL_OFF) return block;
-
+// Grows the image by count blocks with a single resize, returns the first of them.
+// Returns NULL_OFF if a striped volume can't take that many more blocks.
+BlockOffset grow_blocks(Mapper* mapper, size_t count) {
     long old_size = mapper->file_size;
-    mapper->file_size += BLOCK_SIZE;
     size_t block_idx = mapper->num_blocks;
-    mapper->num_blocks += 1;
+    if (mapper->stripe_count) {
+        size_t units = (block_idx + count + mapper->stripe_unit - 1) / mapper->stripe_unit;
+        // Checked before any file is extended, so a full volume can still be opened again
+        if (units > mapper->max_units) {
+            puts("striped volume is full");
+            return NULL_OFF;
+        }
+        for (; mapper->num_units < units; mapper->num_units++) {
+            if (map_stripe_unit(mapper, mapper->num_units) == -1) return NULL_OFF;
+        }
+        mapper->file_size += count * BLOCK_SIZE;
+        mapper->num_blocks += count;
+        mapper->root->volume_blocks = mapper->num_blocks;
+        return block_idx * BLOCK_SIZE;
+    }
+    mapper->file_size += count * BLOCK_SIZE;
+    mapper->num_blocks += count;
+    // mremap fails on a range split into several regions by madvise
+    if (mapper->random_advised) {
+        madvise(mapper->root, old_size, MADV_NORMAL);
+        mapper->random_advised = 0;
+        mapper->advice_epoch++;
+    }
     if (ftruncate(mapper->file, mapper->file_size) == -1) {
         perror("ftruncate");
         close(mapper->file);
@@ -186,18 +498,28 @@ BlockOffset get_block(Mapper* mapper) {
         exit(1);
     }
     mapper->root = (RootNode*)new_map;
-    block = block_idx * BLOCK_SIZE;
-    return block;
+    if (mapper->hints & MAPPING_HINT_HUGEPAGES) {
+        madvise(OUT_OFFSET(mapper->root, block_idx * BLOCK_SIZE), count * BLOCK_SIZE, MADV_HUGEPAGE);
+    }
+    return block_idx * BLOCK_SIZE;
+}
+
+BlockOffset get_block(Mapper* mapper) {
+    BlockOffset block = get_first_empty_block(mapper->root);
+    if (block != NULL_OFF) return block;
+    return grow_blocks(mapper, 1);
 }
 
 BlockOffset new_data_block(Mapper* mapper) {
     BlockOffset block = get_block(mapper);
+    if (block == NULL_OFF) return NULL_OFF;
     memset(OUT_OFFSET(mapper->root, block), 0, BLOCK_SIZE);
     return block;
 }
 
 BlockOffset new_node_block(Mapper* mapper) {
     BlockOffset b = get_block(mapper);
+    if (b == NULL_OFF) return NULL_OFF;
     Block* block = (Block*)OUT_OFFSET(mapper->root, b);
     block->node.next_block = NULL_OFF;
     block->node.node_count = 0;
@@ -234,6 +556,7 @@ NodeOffset get_node(Mapper* mapper) {
     Block* first = (Block*)OUT_OFFSET(mapper->root, f);
     if (f == NULL_OFF || first->node.node_count >= MAX_NODE_COUNT) {
         BlockOffset b = new_node_block(mapper);
+        if (b == NULL_OFF) return NULL_OFF;
         NodeBlock* block = (NodeBlock*)OUT_OFFSET(mapper->root, b);
         block->node_count = 1;
         block->next_block = f;
@@ -255,8 +578,9 @@ void delete_file_node_content(Mapper* mapper, Node* node) {
     BlockOffset b = node->node.file.first_block;
     while (b != NULL_OFF) {
         Block* block = (Block*)OUT_OFFSET(mapper->root, b);
-        delete_block(mapper, block);
+        // Freeing the block overwrites next_block
         b = block->data.next_block;
+        delete_block(mapper, block);
     }
 }
 
@@ -266,6 +590,7 @@ void delete_dir_node_content(Mapper* mapper, Node* node) {
     NodeOffset c = node->node.dir.first_child;
     while (c != NULL_OFF) {
         Node* child = (Node*)OUT_OFFSET(mapper->root, c);
+        c = child->next_sibling;
         delete_node(mapper, child);
     }
 }
@@ -277,10 +602,11 @@ void delete_node(Mapper* mapper, Node* node) {
     }
     switch (node->type) {
         case FIL:
-            delete_dir_node_content(mapper, node);
+            delete_file_node_content(mapper, node);
             break;
         case DIR:
-            delete_file_node_content(mapper, node);
+            delete_dir_node_content(mapper, node);
+            break;
         default:
             return;
     }
@@ -296,7 +622,67 @@ void close_mapper(Mapper* mapper) {
         close(mapper->file);
         exit(1);
     }
-    close(mapper->file);
+    if (mapper->stripe_count == 0) {
+        munmap(mapper->root, mapper->file_size);
+        close(mapper->file);
+        return;
+    }
+    // Hands the unit mappings back, they count against vm.max_map_count
+    munmap(mapper->root, MAX_VOLUME_SIZE);
+    for (size_t i = 0; i < mapper->stripe_count; i++) {
+        close(mapper->stripes[i].file);
+    }
+}
+
+// Faults in every node block. Node blocks added together sit next to each other with the
+// chain running downwards, so whenever the walk steps onto a neighbour the blocks below it
+// are hinted ahead of the walk.
+void populate_metadata(Mapper* mapper) {
+    size_t hinted = 0;
+    BlockOffset b = mapper->root->first_block;
+    while (b != NULL_OFF) {
+        BlockOffset next = ((NodeBlock*)OUT_OFFSET(mapper->root, b))->next_block;
+        if (hinted == 0 && next != NULL_OFF && next + BLOCK_SIZE == b) {
+            hinted = min(READAHEAD_MAX, b / BLOCK_SIZE - 1);
+            madvise(OUT_OFFSET(mapper->root, b - hinted * BLOCK_SIZE), hinted * BLOCK_SIZE, MADV_WILLNEED);
+        }
+        if (hinted > 0) hinted--;
+        b = next;
+    }
+}
+
+// Applies MAPPING_HINT_* flags to the whole mapping. Returns -1 if the kernel refused one,
+// huge pages in particular are only available for file mappings on some filesystems.
+int set_mapping_hints(Mapper* mapper, int hints) {
+    int ret = 0;
+    mapper->hints = hints;
+    if (hints & MAPPING_HINT_HUGEPAGES) {
+        // Striped volumes are advised in whole units so no unit mapping gets split
+        size_t len = mapper->stripe_count ? mapper->num_units * mapper->stripe_unit * BLOCK_SIZE : (size_t)mapper->file_size;
+        if (madvise(mapper->root, len, MADV_HUGEPAGE) == -1) ret = -1;
+    }
+    if (hints & MAPPING_HINT_POPULATE) {
+#ifdef MADV_POPULATE_READ
+        if (madvise(mapper->root, mapper->file_size, MADV_POPULATE_READ) == 0) return ret;
+#endif
+        if (madvise(mapper->root, mapper->file_size, MADV_WILLNEED) == -1) ret = -1;
+    } else if (hints & MAPPING_HINT_METADATA) {
+        populate_metadata(mapper);
+    }
+    return ret;
+}
+
+// Writes the image back and evicts it from memory, so the next accesses are cold
+int drop_cache(Mapper* mapper) {
+    if (msync(mapper->root, mapper->file_size, MS_SYNC) == -1) return -1;
+    if (madvise(mapper->root, mapper->file_size, MADV_DONTNEED) == -1) return -1;
+    if (mapper->stripe_count == 0) {
+        return posix_fadvise(mapper->file, 0, 0, POSIX_FADV_DONTNEED) == 0 ? 0 : -1;
+    }
+    for (size_t i = 0; i < mapper->stripe_count; i++) {
+        if (posix_fadvise(mapper->stripes[i].file, 0, 0, POSIX_FADV_DONTNEED) != 0) return -1;
+    }
+    return 0;
 }
 
 void initialize_dir(Mapper* mapper, Node* dir) {
@@ -325,10 +711,14 @@ NodeOffset create_children(Mapper* mapper, Node* dir, char* name) {
             exit(1);
         }
     }
+    // get_node may move the mapping
+    NodeOffset d = MAP_OFFSET(mapper->root, dir);
     NodeOffset nc = get_node(mapper);
+    if (nc == NULL_OFF) return NULL_OFF;
     Node* new_child = (Node*)OUT_OFFSET(mapper->root, nc);
+    dir = (Node*)OUT_OFFSET(mapper->root, d);
 
-    new_child->parent = MAP_OFFSET(mapper->root, dir);
+    new_child->parent = d;
     strncpy(new_child->name, name, MAX_NAME_LENGTH);
 
     NodeOffset first_child = dir->node.dir.first_child;
@@ -342,7 +732,7 @@ int delete_child(Mapper* mapper, NodeOffset n) {
     NodeOffset p = child->parent;
     Node* parent = (Node*)OUT_OFFSET(mapper->root, p);
     if (parent->node.dir.first_child == n) {
-        parent->node.dir.first_child = NULL_OFF;
+        parent->node.dir.first_child = child->next_sibling;
         delete_node(mapper, child);
         return 1;
     }
@@ -363,149 +753,427 @@ int delete_child(Mapper* mapper, NodeOffset n) {
     return -1;
 }
 
-void create_dir(Mapper* mapper, NodeOffset d, char* name) {
+NodeOffset create_dir(Mapper* mapper, NodeOffset d, char* name) {
     Node* dir = (Node*)OUT_OFFSET(mapper->root, d);
-    Node* child = (Node*)OUT_OFFSET(mapper->root, create_children(mapper, dir, name));
-    initialize_dir(mapper, child);
+    NodeOffset c = create_children(mapper, dir, name);
+    if (c == NULL_OFF) return NULL_OFF;
+    initialize_dir(mapper, (Node*)OUT_OFFSET(mapper->root, c));
+    return c;
 }
 
-void create_file(Mapper* mapper, NodeOffset d, char* name) {
+NodeOffset create_file(Mapper* mapper, NodeOffset d, char* name) {
     Node* dir = (Node*)OUT_OFFSET(mapper->root, d);
-    Node* child = (Node*)OUT_OFFSET(mapper->root, create_children(mapper, dir, name));
-    initialize_file(mapper, child);
+    NodeOffset c = create_children(mapper, dir, name);
+    if (c == NULL_OFF) return NULL_OFF;
+    initialize_file(mapper, (Node*)OUT_OFFSET(mapper->root, c));
+    return c;
+}
+
+// Hints count blocks starting at block, clamped to the image
+void advise_blocks(Mapper* mapper, BlockOffset block, size_t count, int advice) {
+    size_t start = block / BLOCK_SIZE;
+    size_t end = min(start + count, mapper->num_blocks);
+    if (block == NULL_OFF || start >= end) return;
+    madvise(OUT_OFFSET(mapper->root, block), (end - start) * BLOCK_SIZE, advice);
+}
+
+void undo_random_advice(Mapper* mapper, FD* entry) {
+    // A newer epoch means grow_blocks already cleared it
+    if (entry->random_blocks && entry->random_epoch == mapper->advice_epoch) {
+        advise_blocks(mapper, entry->random_start, entry->random_blocks, MADV_NORMAL);
+    }
+    entry->random_blocks = 0;
+}
+
+// Only covers blocks this fd has walked without seeing a gap, so they are known to be the file's
+// Striped volumes skip it, splitting their unit mappings would eat into the max_map_count budget.
+void advise_random(Mapper* mapper, FD* entry, BlockOffset first) {
+    if (entry->fragmented || first == NULL_OFF || mapper->stripe_count) return;
+    size_t count = entry->walked_to + 1;
+    if (entry->random_epoch == mapper->advice_epoch && entry->random_blocks >= count) return;
+    advise_blocks(mapper, first, count, MADV_RANDOM);
+    entry->random_start = first;
+    entry->random_blocks = count;
+    entry->random_epoch = mapper->advice_epoch;
+    mapper->random_advised = 1;
+}
+
+size_t fd_handle(FDTable* table, size_t i) {
+    return ((size_t)table->entries[i].generation << FD_INDEX_BITS) | i;
+}
+
+// Returns NULL for descriptors that were never handed out or have been closed since
+FD* get_fd(Mapper* mapper, size_t fd) {
+    FDTable* table = &mapper->fd_table;
+    size_t i = fd & (MAX_FD - 1);
+    if (i >= table->count) return NULL;
+    FD* entry = &table->entries[i];
+    if (!entry->in_use || entry->generation != fd >> FD_INDEX_BITS) return NULL;
+    return entry;
 }
 
 size_t get_empty_fd(Mapper* mapper) {
-    for (size_t i = 0; i < MAX_FD; i++) {
-        if (!mapper->fd_table[i].in_use) {
-            return i;
-        }
+    FDTable* table = &mapper->fd_table;
+    if (table->free_count > 0) {
+        return table->free_slots[--table->free_count];
     }
-    return MAX_FD;
+    if (table->count == MAX_FD) return INVALID_FD;
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 64;
+        FD* entries = (FD*)realloc(table->entries, capacity * sizeof(FD));
+        size_t* free_slots = (size_t*)realloc(table->free_slots, capacity * sizeof(size_t));
+        if (entries) table->entries = entries;
+        if (free_slots) table->free_slots = free_slots;
+        if (entries == NULL || free_slots == NULL) return INVALID_FD;
+        table->capacity = capacity;
+    }
+    table->entries[table->count].generation = 0;
+    return table->count++;
 }
 
 size_t open_file(Mapper* mapper, Node* file) {
     size_t i = get_empty_fd(mapper);
-    FD* fd = &mapper->fd_table[i];
+    if (i == INVALID_FD) return INVALID_FD;
+    FD* fd = &mapper->fd_table.entries[i];
+    unsigned generation = fd->generation;
+    memset(fd, 0, sizeof(FD));
+    fd->generation = generation;
     fd->in_use = 1;
     fd->file = MAP_OFFSET(mapper->root, file);
-    fd->offset = 0;
-    return i;
+    fd->cursor_block = NULL_OFF;
+    return fd_handle(&mapper->fd_table, i);
 }
 
-void close_file(Mapper* mapper, size_t fd) {
-    mapper->fd_table[fd].in_use = 0;
+int close_file(Mapper* mapper, size_t fd) {
+    FD* entry = get_fd(mapper, fd);
+    if (entry == NULL) return -1;
+    undo_random_advice(mapper, entry);
+    entry->in_use = 0;
+    entry->generation++;
+    mapper->fd_table.free_slots[mapper->fd_table.free_count++] = fd & (MAX_FD - 1);
+    return 0;
 }
 
-size_t min(size_t a, size_t b) {
-    if (a < b) return a;
-    return b;
+// A piece of a read or write that falls inside a single data block
+typedef struct {
+    BlockOffset block;
+    size_t block_offset;
+    size_t len;
+    char* buf;
+} CopySegment;
+
+typedef struct {
+    Mapper* mapper;
+    CopySegment* segments;
+    size_t count;
+    size_t stripe;
+    int write;
+} StripeCopy;
+
+void copy_segment(Mapper* mapper, CopySegment* seg, int write) {
+    char* data = ((Block*)OUT_OFFSET(mapper->root, seg->block))->data.data + seg->block_offset;
+    if (write) {
+        memcpy(data, seg->buf, seg->len);
+    } else {
+        memcpy(seg->buf, data, seg->len);
+    }
+}
+
+void* stripe_copy_worker(void* arg) {
+    StripeCopy* job = (StripeCopy*)arg;
+    for (size_t i = 0; i < job->count; i++) {
+        if (block_stripe(job->mapper, job->segments[i].block) == job->stripe) {
+            copy_segment(job->mapper, &job->segments[i], job->write);
+        }
+    }
+    return NULL;
+}
+
+// Large transfers on a striped volume are split so every backing file faults its pages in at once.
+// Only striped volumes get here, their mapping doesn't move, so the copies can run unlocked.
+int use_stripe_copy(Mapper* mapper, size_t len) {
+    return mapper->stripe_count > 1 && len >= STRIPE_PARALLEL_BLOCKS * MAX_DATA_CAPACITY;
+}
+
+void copy_stripes(Mapper* mapper, CopySegment* segments, size_t count, int write) {
+    StripeCopy jobs[MAX_STRIPES];
+    pthread_t ids[MAX_STRIPES];
+    int started[MAX_STRIPES] = {0};
+    for (size_t i = 0; i < mapper->stripe_count; i++) {
+        jobs[i] = (StripeCopy){ .mapper = mapper, .segments = segments, .count = count, .stripe = i, .write = write };
+        started[i] = i > 0 && pthread_create(&ids[i], NULL, stripe_copy_worker, &jobs[i]) == 0;
+    }
+    stripe_copy_worker(&jobs[0]);
+    for (size_t i = 1; i < mapper->stripe_count; i++) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        } else {
+            stripe_copy_worker(&jobs[i]);
+        }
+    }
+}
+
+AccessPattern classify_access(FD* entry, size_t offset) {
+    if (offset == entry->last_end) return ACCESS_SEQUENTIAL;
+    long stride = (long)(offset - entry->last_offset);
+    if (stride != 0 && stride == entry->stride) return ACCESS_STRIDED;
+    return ACCESS_RANDOM;
+}
+
+// Called after every read. Files written in one go sit in consecutive blocks, so until a gap
+// shows up block i of the file is taken to be i blocks after the first one and the upcoming
+// blocks get MADV_WILLNEED without walking the chain, a wrong guess only wastes the hint.
+// MADV_RANDOM would turn off readahead for whatever it lands on, so it is never guessed.
+void update_readahead(Mapper* mapper, FD* entry, size_t offset, size_t len) {
+    Node* file = (Node*)OUT_OFFSET(mapper->root, entry->file);
+    BlockOffset first = file->node.file.first_block;
+    size_t size = file->node.file.size;
+    size_t num_blocks = blocks_for_size(size);
+
+    AccessPattern seen = classify_access(entry, offset);
+    entry->stride = (long)(offset - entry->last_offset);
+    entry->last_offset = offset;
+    entry->last_end = offset + len;
+    if (seen == entry->candidate) {
+        entry->hits++;
+    } else {
+        entry->candidate = seen;
+        entry->hits = 1;
+    }
+    if (entry->hits >= ACCESS_CONFIRM && seen != entry->pattern) {
+        if (entry->pattern == ACCESS_RANDOM) {
+            undo_random_advice(mapper, entry);
+        }
+        entry->pattern = seen;
+        entry->window = 0;
+        entry->prefetched_to = 0;
+    }
+
+    size_t last_index = (offset + len - 1) / MAX_DATA_CAPACITY;
+    switch (entry->pattern) {
+        case ACCESS_SEQUENTIAL: {
+            entry->window = entry->window ? min(entry->window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+            if (entry->fragmented) {
+                // Only the next block is known without faulting in the chain
+                DataBlock* last = (DataBlock*)OUT_OFFSET(mapper->root, entry->cursor_block);
+                if (last->next_block != NULL_OFF) {
+                    advise_blocks(mapper, last->next_block, 1, MADV_WILLNEED);
+                }
+                break;
+            }
+            // The next window is issued once the reader is halfway through the last one
+            if (entry->prefetched_to > last_index + entry->window / 2) break;
+            size_t from = entry->prefetched_to > last_index ? entry->prefetched_to : last_index + 1;
+            size_t end = min(last_index + 1 + entry->window, num_blocks);
+            if (from < end) {
+                advise_blocks(mapper, first + from * BLOCK_SIZE, end - from, MADV_WILLNEED);
+                entry->prefetched_to = end;
+            }
+            break;
+        }
+        case ACCESS_STRIDED: {
+            long next = (long)offset + entry->stride;
+            if (entry->fragmented || next < 0 || (size_t)next >= size) break;
+            size_t from = next / MAX_DATA_CAPACITY;
+            size_t end = (min(next + len, size) - 1) / MAX_DATA_CAPACITY + 1;
+            advise_blocks(mapper, first + from * BLOCK_SIZE, end - from, MADV_WILLNEED);
+            break;
+        }
+        case ACCESS_RANDOM:
+            advise_random(mapper, entry, first);
+            break;
+        default:
+            break;
+    }
+}
+
+// Cuts the chain of a file down to what its size needs and frees the rest
+void trim_file_chain(Mapper* mapper, NodeOffset file) {
+    size_t keep = blocks_for_size(((Node*)OUT_OFFSET(mapper->root, file))->node.file.size);
+    BlockOffset b = ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block;
+    if (keep == 0) {
+        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block = NULL_OFF;
+    } else {
+        for (size_t i = 1; i < keep; i++) {
+            b = ((Block*)OUT_OFFSET(mapper->root, b))->data.next_block;
+        }
+        BlockOffset last = b;
+        b = ((Block*)OUT_OFFSET(mapper->root, last))->data.next_block;
+        ((Block*)OUT_OFFSET(mapper->root, last))->data.next_block = NULL_OFF;
+    }
+    while (b != NULL_OFF) {
+        Block* block = (Block*)OUT_OFFSET(mapper->root, b);
+        b = block->data.next_block;
+        delete_block(mapper, block);
+    }
 }
 
 // In these functions, we only store offsets since we are constantly using functions that may reallocate
 
+// Returns the bytes written, which fall short of len if the image couldn't grow
 int write_file(Mapper* mapper, size_t fd, void* data, size_t len) {
-    FD* entry = &mapper->fd_table[fd];
-    assert(entry->in_use);
+    FD* entry = get_fd(mapper, fd);
+    if (entry == NULL) return -1;
     size_t offset = entry->offset;
     NodeOffset file = entry->file;
 
     size_t file_length = ((Node*)OUT_OFFSET(mapper->root, file))->node.file.size;
-    if (offset + len >= file_length) {
-        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.size = offset + len + 1;
-    }
-
-    size_t num_block = offset / BLOCK_SIZE;
+    size_t num_block = offset / MAX_DATA_CAPACITY;
+    int full = 0;
 
     if (((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block == NULL_OFF) {
-        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block = new_data_block(mapper);
+        BlockOffset new_block = new_data_block(mapper);
+        if (new_block == NULL_OFF) return -1;
+        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block = new_block;
     }
 
     BlockOffset block = ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block;
     for (size_t i = 0; i < num_block; i++) {
         if (((Block*)OUT_OFFSET(mapper->root, block))->data.next_block == NULL_OFF) {
             BlockOffset new_block = new_data_block(mapper);
+            if (new_block == NULL_OFF) {
+                full = 1;
+                break;
+            }
             ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block = new_block;
         }
         block = ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block;
     }
 
-    size_t block_offset = offset % BLOCK_SIZE;
+    int striped = use_stripe_copy(mapper, len);
+    CopySegment* segments = striped ? (CopySegment*)malloc((len / MAX_DATA_CAPACITY + 2) * sizeof(CopySegment)) : NULL;
+    size_t num_segments = 0;
+
+    size_t block_offset = offset % MAX_DATA_CAPACITY;
     size_t n_written = 0;
-    while (n_written != len) {
-        char* dst = ((Block*)OUT_OFFSET(mapper->root, block))->data.data + block_offset;
-        size_t n = min(BLOCK_SIZE - block_offset, len - n_written);
-        memcpy(dst, ((char*)data) + n_written, n);
+    while (n_written != len && !full) {
+        size_t n = min(MAX_DATA_CAPACITY - block_offset, len - n_written);
+        CopySegment seg = { block, block_offset, n, ((char*)data) + n_written };
+        if (striped) {
+            segments[num_segments++] = seg;
+        } else {
+            copy_segment(mapper, &seg, 1);
+        }
         n_written += n;
         block_offset = 0;
         if (n_written != len && ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block == NULL_OFF) {
             BlockOffset new_block = new_data_block(mapper);
+            if (new_block == NULL_OFF) {
+                full = 1;
+                break;
+            }
             ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block = new_block;
         }
         block = ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block;
     }
+    if (striped) {
+        copy_stripes(mapper, segments, num_segments, 1);
+        free(segments);
+    }
 
+    if (n_written && offset + n_written > file_length) {
+        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.size = offset + n_written;
+    }
+    if (full) {
+        // Blocks added for a write that didn't happen go back on the free list
+        trim_file_chain(mapper, file);
+        if (n_written == 0) return -1;
+    }
     entry->offset += n_written;
     return n_written;
 }
 
 int read_file(Mapper* mapper, size_t fd, void* data, size_t len) {
-    FD* entry = &mapper->fd_table[fd];
-    assert(entry->in_use);
+    FD* entry = get_fd(mapper, fd);
+    if (entry == NULL) return -1;
     size_t offset = entry->offset;
     NodeOffset file = entry->file;
 
     size_t file_length = ((Node*)OUT_OFFSET(mapper->root, file))->node.file.size;
+    if (offset >= file_length || len == 0) return 0;
     len = min(len, file_length - offset);
 
-    size_t num_block = offset / BLOCK_SIZE;
+    size_t num_block = offset / MAX_DATA_CAPACITY;
 
     if (((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block == NULL_OFF) {
-        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block = new_data_block(mapper);
+        BlockOffset new_block = new_data_block(mapper);
+        if (new_block == NULL_OFF) return -1;
+        ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block = new_block;
     }
 
     BlockOffset block = ((Node*)OUT_OFFSET(mapper->root, file))->node.file.first_block;
-    for (size_t i = 0; i < num_block; i++) {
+    size_t i = 0;
+    if (entry->cursor_block != NULL_OFF && entry->cursor_index <= num_block) {
+        block = entry->cursor_block;
+        i = entry->cursor_index;
+    }
+    for (; i < num_block; i++) {
         if (((Block*)OUT_OFFSET(mapper->root, block))->data.next_block == NULL_OFF) {
             BlockOffset new_block = new_data_block(mapper);
+            if (new_block == NULL_OFF) return -1;
             ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block = new_block;
         }
-        block = ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block;
+        BlockOffset next = ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block;
+        if (next != block + BLOCK_SIZE) entry->fragmented = 1;
+        block = next;
     }
 
-    size_t block_offset = offset % BLOCK_SIZE;
+    int striped = use_stripe_copy(mapper, len);
+    CopySegment* segments = striped ? (CopySegment*)malloc((len / MAX_DATA_CAPACITY + 2) * sizeof(CopySegment)) : NULL;
+    size_t num_segments = 0;
+
+    size_t block_offset = offset % MAX_DATA_CAPACITY;
     size_t n_read = 0;
+    BlockOffset last = block;
     while (n_read != len) {
-        char* src = ((Block*)OUT_OFFSET(mapper->root, block))->data.data + block_offset;
-        size_t n = min(BLOCK_SIZE - block_offset, len - n_read);
-        memcpy(((char*)data) + n_read, src, n);
+        size_t n = min(MAX_DATA_CAPACITY - block_offset, len - n_read);
+        CopySegment seg = { block, block_offset, n, ((char*)data) + n_read };
+        if (striped) {
+            segments[num_segments++] = seg;
+        } else {
+            copy_segment(mapper, &seg, 0);
+        }
         n_read += n;
         block_offset = 0;
         if (n_read != len && ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block == NULL_OFF) {
             BlockOffset new_block = new_data_block(mapper);
+            if (new_block == NULL_OFF) return -1;
             ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block = new_block;
         }
+        last = block;
         block = ((Block*)OUT_OFFSET(mapper->root, block))->data.next_block;
+        if (n_read != len && block != last + BLOCK_SIZE) entry->fragmented = 1;
+    }
+    if (striped) {
+        copy_stripes(mapper, segments, num_segments, 0);
+        free(segments);
     }
 
+    entry->cursor_block = last;
+    entry->cursor_index = (offset + len - 1) / MAX_DATA_CAPACITY;
+    if (entry->cursor_index > entry->walked_to) entry->walked_to = entry->cursor_index;
+    if (mapper->readahead) {
+        update_readahead(mapper, entry, offset, len);
+    }
     entry->offset += n_read;
     return len;
 }
 
-void seek_file(Mapper* mapper, size_t fd, size_t offset, int flag) {
-    FD* entry = &mapper->fd_table[fd];
-    assert(entry->in_use);
+int seek_file(Mapper* mapper, size_t fd, size_t offset, int flag) {
+    FD* entry = get_fd(mapper, fd);
+    if (entry == NULL) return -1;
     Node* file = (Node*)OUT_OFFSET(mapper->root, entry->file);
     switch (flag) {
         case SEEK_SET:
             entry->offset = offset;
             break;
         case SEEK_END:
-            entry->offset = file->node.file.size - offset - 1;
+            entry->offset = file->node.file.size - offset;
             break;
         case SEEK_CUR:
             entry->offset += offset;
     }
+    return 0;
 }
 
 DirIterator create_iterator(Mapper* mapper, NodeOffset n) {
@@ -577,3 +1245,1034 @@ NodeOffset traverse_path(Mapper* mapper, NodeOffset dir, char* path) {
         path = path + end + 1;
     }
 }
+
+// Batched metadata operations. A batch checks all of its names against the
+// directory in one pass and takes its nodes from contiguous node block slots.
+
+#define NAME_SET_EMPTY ((size_t)-1)
+
+typedef struct {
+    char** names;
+    size_t* slots;
+    size_t mask;
+} NameSet;
+
+size_t hash_name(char* name) {
+    size_t h = 14695981039346656037UL;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// Returns the index of the matching name, or NAME_SET_EMPTY
+size_t name_set_find(NameSet* set, char* name) {
+    for (size_t i = hash_name(name) & set->mask;; i = (i + 1) & set->mask) {
+        size_t slot = set->slots[i];
+        if (slot == NAME_SET_EMPTY || strcmp(set->names[slot], name) == 0) return slot;
+    }
+}
+
+// Returns -1 if names has duplicates
+int name_set_init(NameSet* set, char** names, size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    set->names = names;
+    set->mask = capacity - 1;
+    set->slots = (size_t*)malloc(capacity * sizeof(size_t));
+    memset(set->slots, 0xff, capacity * sizeof(size_t));
+    for (size_t n = 0; n < count; n++) {
+        size_t i = hash_name(names[n]) & set->mask;
+        while (set->slots[i] != NAME_SET_EMPTY) {
+            if (strcmp(names[set->slots[i]], names[n]) == 0) {
+                free(set->slots);
+                return -1;
+            }
+            i = (i + 1) & set->mask;
+        }
+        set->slots[i] = n;
+    }
+    return 0;
+}
+
+// Looks up many names in a directory with a single scan of it, out[i] is NULL_OFF for missing names
+int lookup_children(Mapper* mapper, NodeOffset dir, char** names, size_t count, NodeOffset* out) {
+    NameSet set;
+    if (name_set_init(&set, names, count) == -1) return -1;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = NULL_OFF;
+    }
+    DirIterator iter = create_iterator(mapper, dir);
+    NodeOffset n;
+    while (n = iter_next(&iter), n != NULL_OFF) {
+        size_t found = name_set_find(&set, ((Node*)OUT_OFFSET(mapper->root, n))->name);
+        if (found != NAME_SET_EMPTY) out[found] = n;
+    }
+    free(set.slots);
+    return 0;
+}
+
+// Allocates count nodes from contiguous slots. The current node block is filled first,
+// then all the node blocks still needed are added with a single resize.
+// Returns -1 without taking any node if the image can't grow.
+int get_nodes(Mapper* mapper, size_t count, NodeOffset* out) {
+    BlockOffset f = mapper->root->first_block;
+    size_t free_slots = 0;
+    if (f != NULL_OFF) {
+        free_slots = MAX_NODE_COUNT - ((NodeBlock*)OUT_OFFSET(mapper->root, f))->node_count;
+    }
+    size_t num_blocks = count > free_slots ? (count - free_slots + MAX_NODE_COUNT - 1) / MAX_NODE_COUNT : 0;
+    BlockOffset b = num_blocks ? grow_blocks(mapper, num_blocks) : NULL_OFF;
+    if (num_blocks && b == NULL_OFF) return -1;
+
+    size_t got = 0;
+    if (f != NULL_OFF) {
+        NodeBlock* first = (NodeBlock*)OUT_OFFSET(mapper->root, f);
+        for (; got < count && first->node_count < MAX_NODE_COUNT; got++) {
+            out[got] = MAP_OFFSET(mapper->root, &first->nodes[first->node_count++]);
+        }
+    }
+    if (got == count) return 0;
+
+    // The last block may be partially filled, so it goes at the head of the chain
+    for (size_t i = 0; i < num_blocks; i++, b += BLOCK_SIZE) {
+        NodeBlock* block = (NodeBlock*)OUT_OFFSET(mapper->root, b);
+        block->next_block = mapper->root->first_block;
+        block->node_count = 0;
+        mapper->root->first_block = b;
+        for (; got < count && block->node_count < MAX_NODE_COUNT; got++) {
+            out[got] = MAP_OFFSET(mapper->root, &block->nodes[block->node_count++]);
+        }
+    }
+    return 0;
+}
+
+// Names that can't be mistaken for path syntax, here or on the host
+int valid_node_name(char* name) {
+    return strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+// Creates count children of the same type, out gets their offsets in the same order.
+// Nothing is created if any name is too long, invalid, repeated or already taken.
+int create_children_batch(Mapper* mapper, NodeOffset d, char** names, size_t count, NodeType type, NodeOffset* out) {
+    assert(((Node*)OUT_OFFSET(mapper->root, d))->type == DIR);
+    assert(type == DIR || type == FIL);
+    if (count == 0) return 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strlen(names[i]) >= MAX_NAME_LENGTH) {
+            printf("name %s is too long\n", names[i]);
+            return -1;
+        }
+        if (!valid_node_name(names[i])) {
+            printf("invalid name %s\n", names[i]);
+            return -1;
+        }
+    }
+
+    NodeOffset* nodes = (NodeOffset*)malloc(count * sizeof(NodeOffset));
+    if (lookup_children(mapper, d, names, count, nodes) == -1) {
+        puts("there are repeated names");
+        free(nodes);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (nodes[i] != NULL_OFF) {
+            printf("there already is a node with the name %s\n", names[i]);
+            free(nodes);
+            return -1;
+        }
+    }
+
+    if (get_nodes(mapper, count, nodes) == -1) {
+        free(nodes);
+        return -1;
+    }
+    Node* dir = (Node*)OUT_OFFSET(mapper->root, d);
+    NodeOffset next = dir->node.dir.first_child;
+    for (size_t i = count; i-- > 0;) {
+        Node* child = (Node*)OUT_OFFSET(mapper->root, nodes[i]);
+        child->parent = d;
+        // Lengths were checked above
+        memcpy(child->name, names[i], strlen(names[i]) + 1);
+        if (type == DIR) {
+            initialize_dir(mapper, child);
+        } else {
+            initialize_file(mapper, child);
+        }
+        child->next_sibling = next;
+        next = nodes[i];
+    }
+    dir->node.dir.first_child = next;
+
+    if (out) memcpy(out, nodes, count * sizeof(NodeOffset));
+    free(nodes);
+    return 0;
+}
+
+typedef struct {
+    NodeType type;
+    size_t size;
+} NodeStat;
+
+void stat_nodes(Mapper* mapper, NodeOffset* nodes, size_t count, NodeStat* out) {
+    for (size_t i = 0; i < count; i++) {
+        Node* node = (Node*)OUT_OFFSET(mapper->root, nodes[i]);
+        out[i].type = node->type;
+        out[i].size = node->type == FIL ? node->node.file.size : 0;
+    }
+}
+
+// readdir_plus packs these back to back, each one starts 8 byte aligned
+typedef struct {
+    NodeOffset node;
+    size_t size;
+    unsigned short record_len;
+    unsigned char type;
+    unsigned char name_len;
+    char name[];
+} DirEntryPlus;
+
+#define DIR_ENTRY_ALIGN(len) (((len) + 7) & ~(size_t)7)
+// A buffer this big always fits at least one entry
+#define DIR_ENTRY_MAX DIR_ENTRY_ALIGN(sizeof(DirEntryPlus) + MAX_NAME_LENGTH)
+
+// Fills buf with as many entries as fit and returns the bytes used, 0 once the directory is exhausted.
+// The iterator is left at the first entry that didn't fit, so calls can be repeated.
+size_t readdir_plus(DirIterator* iter, void* buf, size_t len) {
+    size_t used = 0;
+    while (iter->node != NULL_OFF) {
+        Node* node = (Node*)OUT_OFFSET(iter->mapper->root, iter->node);
+        size_t name_len = strnlen(node->name, MAX_NAME_LENGTH - 1);
+        size_t record_len = DIR_ENTRY_ALIGN(sizeof(DirEntryPlus) + name_len + 1);
+        if (used + record_len > len) break;
+
+        DirEntryPlus* entry = (DirEntryPlus*)((char*)buf + used);
+        entry->node = iter->node;
+        entry->size = node->type == FIL ? node->node.file.size : 0;
+        entry->record_len = record_len;
+        entry->type = node->type;
+        entry->name_len = name_len;
+        memcpy(entry->name, node->name, name_len);
+        entry->name[name_len] = 0;
+        used += record_len;
+        iter_next(iter);
+    }
+    return used;
+}
+
+// Bulk transfer between a host directory tree and the image.
+// Metadata is created up front, then the data blocks of every file are laid out
+// contiguously in a single growth of the image, so the mapping stays put while
+// worker threads move file contents with vectored reads/writes.
+
+#define TRANSFER_IOV 256
+
+typedef struct {
+    char* host_path;
+    NodeOffset node;
+    size_t size;
+    BlockOffset first_block;
+    // Bytes that made it into the image, less than size if the host file couldn't be read
+    size_t copied;
+} TransferEntry;
+
+typedef struct {
+    TransferEntry* entries;
+    size_t count;
+    size_t capacity;
+} TransferList;
+
+typedef struct {
+    size_t files;
+    size_t dirs;
+    size_t bytes;
+    size_t failed;
+    double seconds;
+} TransferStats;
+
+typedef struct {
+    Mapper* mapper;
+    TransferList* list;
+    size_t next;
+    size_t failed;
+} TransferJob;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t default_thread_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n;
+}
+
+char* join_path(char* dir, char* name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char* path = (char*)malloc(len);
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+void push_transfer(TransferList* list, char* host_path, NodeOffset node, size_t size) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->entries = (TransferEntry*)realloc(list->entries, list->capacity * sizeof(TransferEntry));
+    }
+    TransferEntry* e = &list->entries[list->count++];
+    e->host_path = host_path;
+    e->node = node;
+    e->size = size;
+    e->first_block = NULL_OFF;
+    e->copied = 0;
+}
+
+void free_transfer_list(TransferList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].host_path);
+    }
+    free(list->entries);
+}
+
+// Moves a whole iovec array, retrying on short transfers. Returns -1 on error or early EOF
+int transfer_full(int fd, struct iovec* iov, int count, off_t offset, int write) {
+    while (count > 0) {
+        ssize_t n = write ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        offset += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void run_transfer(TransferJob* job, size_t threads, void* (*worker)(void*)) {
+    if (threads > job->list->count) threads = job->list->count;
+    if (threads <= 1) {
+        worker(job);
+        return;
+    }
+    pthread_t* ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], NULL, worker, job) != 0) break;
+    }
+    if (started == 0) worker(job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+}
+
+int import_entry(Mapper* mapper, TransferEntry* e) {
+    int fd = open(e->host_path, O_RDONLY);
+    if (fd < 0) {
+        perror(e->host_path);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct iovec iov[TRANSFER_IOV];
+    size_t num_blocks = blocks_for_size(e->size);
+    size_t b = 0;
+    while (b < num_blocks) {
+        off_t start = b * MAX_DATA_CAPACITY;
+        int n = 0;
+        for (; n < TRANSFER_IOV && b < num_blocks; n++, b++) {
+            DataBlock* block = (DataBlock*)OUT_OFFSET(mapper->root, e->first_block + b * BLOCK_SIZE);
+            iov[n].iov_base = block->data;
+            iov[n].iov_len = min(MAX_DATA_CAPACITY, e->size - b * MAX_DATA_CAPACITY);
+        }
+        if (transfer_full(fd, iov, n, start, 0) == -1) {
+            fprintf(stderr, "%s: short read\n", e->host_path);
+            close(fd);
+            return -1;
+        }
+        e->copied = min(b * MAX_DATA_CAPACITY, e->size);
+    }
+    close(fd);
+    return 0;
+}
+
+// Cuts a file that couldn't be read in full down to what was copied and frees the rest of its blocks
+void truncate_import(Mapper* mapper, TransferEntry* e) {
+    Node* file = (Node*)OUT_OFFSET(mapper->root, e->node);
+    size_t keep = blocks_for_size(e->copied);
+    size_t num_blocks = blocks_for_size(e->size);
+    file->node.file.size = e->copied;
+    if (keep == 0) {
+        file->node.file.first_block = NULL_OFF;
+    } else {
+        ((DataBlock*)OUT_OFFSET(mapper->root, e->first_block + (keep - 1) * BLOCK_SIZE))->next_block = NULL_OFF;
+    }
+    for (size_t b = keep; b < num_blocks; b++) {
+        delete_block(mapper, (Block*)OUT_OFFSET(mapper->root, e->first_block + b * BLOCK_SIZE));
+    }
+}
+
+void* import_worker(void* arg) {
+    TransferJob* job = (TransferJob*)arg;
+    size_t i;
+    while (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED), i < job->list->count) {
+        if (import_entry(job->mapper, &job->list->entries[i]) == -1) {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    char* path;
+    char* name;
+    size_t size;
+    int is_dir;
+    int created;
+    NodeOffset node;
+} HostEntry;
+
+// Creates the entries of one kind that aren't in the image yet with a single batch
+void create_host_entries(Mapper* mapper, NodeOffset dir, HostEntry* entries, size_t count, int is_dir) {
+    char** names = (char**)malloc(count * sizeof(char*));
+    size_t* idx = (size_t*)malloc(count * sizeof(size_t));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].node == NULL_OFF && entries[i].is_dir == is_dir) {
+            names[n] = entries[i].name;
+            idx[n++] = i;
+        }
+    }
+    NodeOffset* nodes = (NodeOffset*)malloc((n ? n : 1) * sizeof(NodeOffset));
+    if (create_children_batch(mapper, dir, names, n, is_dir ? DIR : FIL, nodes) == 0) {
+        for (size_t i = 0; i < n; i++) {
+            entries[idx[i]].node = nodes[i];
+            entries[idx[i]].created = 1;
+        }
+    }
+    free(nodes);
+    free(idx);
+    free(names);
+}
+
+// Creates the nodes for a host directory, existing directories are merged into
+int collect_import(Mapper* mapper, NodeOffset dir, char* host_dir, TransferList* list, TransferStats* stats) {
+    HOST_DIR* d = opendir(host_dir);
+    if (d == NULL) {
+        perror(host_dir);
+        return -1;
+    }
+    HostEntry* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (strlen(ent->d_name) >= MAX_NAME_LENGTH) {
+            fprintf(stderr, "skipping %s/%s: name too long\n", host_dir, ent->d_name);
+            continue;
+        }
+        char* path = join_path(host_dir, ent->d_name);
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+            perror(path);
+            free(path);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = (HostEntry*)realloc(entries, capacity * sizeof(HostEntry));
+        }
+        HostEntry* e = &entries[count++];
+        e->path = path;
+        e->name = path + strlen(host_dir) + 1;
+        e->size = st.st_size;
+        e->is_dir = S_ISDIR(st.st_mode);
+        e->created = 0;
+    }
+    // Closed before recursing so deep trees don't pile up open directories
+    closedir(d);
+
+    char** names = (char**)malloc((count ? count : 1) * sizeof(char*));
+    NodeOffset* existing = (NodeOffset*)malloc((count ? count : 1) * sizeof(NodeOffset));
+    for (size_t i = 0; i < count; i++) {
+        names[i] = entries[i].name;
+    }
+    lookup_children(mapper, dir, names, count, existing);
+    for (size_t i = 0; i < count; i++) {
+        entries[i].node = existing[i];
+    }
+    free(existing);
+    free(names);
+    create_host_entries(mapper, dir, entries, count, 1);
+    create_host_entries(mapper, dir, entries, count, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        HostEntry* e = &entries[i];
+        if (e->node == NULL_OFF) {
+            free(e->path);
+        } else if (e->is_dir) {
+            if (e->created) {
+                stats->dirs++;
+            } else if (((Node*)OUT_OFFSET(mapper->root, e->node))->type != DIR) {
+                fprintf(stderr, "skipping %s: not a directory in the image\n", e->path);
+                free(e->path);
+                continue;
+            }
+            collect_import(mapper, e->node, e->path, list, stats);
+            free(e->path);
+        } else if (!e->created) {
+            fprintf(stderr, "skipping %s: already exists in the image\n", e->path);
+            free(e->path);
+        } else {
+            push_transfer(list, e->path, e->node, e->size);
+        }
+    }
+    free(entries);
+    return 0;
+}
+
+TransferStats import_tree(Mapper* mapper, NodeOffset dir, char* host_dir, size_t threads) {
+    TransferStats stats = {0};
+    double start = now_seconds();
+    TransferList list = {0};
+    if (collect_import(mapper, dir, host_dir, &list, &stats) == -1) {
+        stats.failed = 1;
+        return stats;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        total += blocks_for_size(list.entries[i].size);
+    }
+    BlockOffset next = total ? grow_blocks(mapper, total) : NULL_OFF;
+    if (total && next == NULL_OFF) {
+        // The nodes are left as empty files
+        stats.files = list.count;
+        stats.failed = list.count;
+        stats.seconds = now_seconds() - start;
+        free_transfer_list(&list);
+        return stats;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        TransferEntry* e = &list.entries[i];
+        Node* file = (Node*)OUT_OFFSET(mapper->root, e->node);
+        file->node.file.size = e->size;
+        if (e->size == 0) continue;
+        e->first_block = next;
+        file->node.file.first_block = next;
+        // Chains are linked up front so a failed worker never leaves a node pointing at a partial one
+        size_t num_blocks = blocks_for_size(e->size);
+        for (size_t b = 0; b < num_blocks; b++) {
+            DataBlock* block = (DataBlock*)OUT_OFFSET(mapper->root, next + b * BLOCK_SIZE);
+            block->next_block = b + 1 < num_blocks ? next + (b + 1) * BLOCK_SIZE : NULL_OFF;
+        }
+        next += num_blocks * BLOCK_SIZE;
+    }
+
+    TransferJob job = { .mapper = mapper, .list = &list, .next = 0, .failed = 0 };
+    run_transfer(&job, threads, import_worker);
+
+    for (size_t i = 0; i < list.count; i++) {
+        TransferEntry* e = &list.entries[i];
+        if (e->copied < e->size) {
+            truncate_import(mapper, e);
+        }
+        stats.bytes += e->copied;
+    }
+
+    stats.files = list.count;
+    stats.failed = job.failed;
+    stats.seconds = now_seconds() - start;
+    free_transfer_list(&list);
+    return stats;
+}
+
+int export_entry(Mapper* mapper, TransferEntry* e) {
+    int fd = open(e->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror(e->host_path);
+        return -1;
+    }
+
+    struct iovec iov[TRANSFER_IOV];
+    BlockOffset block = e->first_block;
+    size_t done = 0;
+    while (done < e->size) {
+        off_t start = done;
+        int n = 0;
+        for (; n < TRANSFER_IOV && done < e->size && block != NULL_OFF; n++) {
+            DataBlock* data = (DataBlock*)OUT_OFFSET(mapper->root, block);
+            iov[n].iov_base = data->data;
+            iov[n].iov_len = min(MAX_DATA_CAPACITY, e->size - done);
+            done += iov[n].iov_len;
+            block = data->next_block;
+        }
+        if (n == 0) {
+            fprintf(stderr, "%s: block chain shorter than file size\n", e->host_path);
+            close(fd);
+            return -1;
+        }
+        if (transfer_full(fd, iov, n, start, 1) == -1) {
+            perror(e->host_path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+void* export_worker(void* arg) {
+    TransferJob* job = (TransferJob*)arg;
+    size_t i;
+    while (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED), i < job->list->count) {
+        if (export_entry(job->mapper, &job->list->entries[i]) == -1) {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int collect_export(Mapper* mapper, NodeOffset dir, char* host_dir, TransferList* list, TransferStats* stats) {
+    if (mkdir(host_dir, 0777) == -1 && errno != EEXIST) {
+        perror(host_dir);
+        return -1;
+    }
+    DirIterator iter = create_iterator(mapper, dir);
+    NodeOffset n;
+    while (n = iter_next(&iter), n != NULL_OFF) {
+        Node* node = (Node*)OUT_OFFSET(mapper->root, n);
+        if (!valid_node_name(node->name)) {
+            fprintf(stderr, "skipping %s/%s: not a valid host name\n", host_dir, node->name);
+            continue;
+        }
+        char* path = join_path(host_dir, node->name);
+        if (node->type == DIR) {
+            stats->dirs++;
+            collect_export(mapper, n, path, list, stats);
+            free(path);
+        } else if (node->type == FIL) {
+            push_transfer(list, path, n, node->node.file.size);
+            list->entries[list->count - 1].first_block = node->node.file.first_block;
+            stats->bytes += node->node.file.size;
+        } else {
+            free(path);
+        }
+    }
+    return 0;
+}
+
+TransferStats export_tree(Mapper* mapper, NodeOffset dir, char* host_dir, size_t threads) {
+    TransferStats stats = {0};
+    double start = now_seconds();
+    TransferList list = {0};
+    if (collect_export(mapper, dir, host_dir, &list, &stats) == -1) {
+        stats.failed = 1;
+        return stats;
+    }
+
+    TransferJob job = { .mapper = mapper, .list = &list, .next = 0, .failed = 0 };
+    run_transfer(&job, threads, export_worker);
+
+    stats.files = list.count;
+    stats.failed = job.failed;
+    stats.seconds = now_seconds() - start;
+    free_transfer_list(&list);
+    return stats;
+}
+
+// Consistency checker. The node block chain and both free lists are walked first,
+// then worker threads walk the directory tree from a shared work stack, marking
+// every node and data block they reach in atomic bitmaps. Anything marked twice
+// is cross-linked, anything never marked is leaked.
+
+#define FSCK_SPLIT_BLOCKS 64
+
+typedef struct {
+    size_t blocks;
+    size_t node_blocks;
+    size_t data_blocks;
+    size_t free_blocks;
+    size_t nodes;
+    size_t free_nodes;
+    size_t bad_offsets;
+    size_t cross_linked;
+    size_t free_in_use;
+    size_t leaked_blocks;
+    size_t leaked_nodes;
+    size_t bad_parents;
+    size_t bad_sizes;
+    int repaired;
+    double seconds;
+} FsckReport;
+
+typedef unsigned long Bitmap;
+
+#define BITMAP_BITS (sizeof(Bitmap) * 8)
+
+Bitmap* new_bitmap(size_t bits) {
+    return (Bitmap*)calloc((bits + BITMAP_BITS - 1) / BITMAP_BITS, sizeof(Bitmap));
+}
+
+int bitmap_get(Bitmap* map, size_t bit) {
+    return (map[bit / BITMAP_BITS] >> (bit % BITMAP_BITS)) & 1;
+}
+
+// Returns the previous value of the bit
+int bitmap_test_and_set(Bitmap* map, size_t bit) {
+    Bitmap mask = (Bitmap)1 << (bit % BITMAP_BITS);
+    return (__atomic_fetch_or(&map[bit / BITMAP_BITS], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+typedef struct {
+    Mapper* mapper;
+    Bitmap* used_blocks;
+    Bitmap* free_blocks;
+    // Indices of the node blocks in ascending order. A node's bit in used_nodes and free_nodes
+    // is its block's position here times MAX_NODE_COUNT plus its slot, so those bitmaps
+    // scale with the metadata instead of the image.
+    size_t* node_blocks;
+    size_t node_block_count;
+    Bitmap* used_nodes;
+    Bitmap* free_nodes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    NodeOffset* stack;
+    size_t stack_len;
+    size_t stack_cap;
+    size_t active;
+
+    FsckReport report;
+} FsckState;
+
+int fsck_valid_block(FsckState* state, BlockOffset b) {
+    return b != NULL_OFF && b % BLOCK_SIZE == 0 && b / BLOCK_SIZE < state->mapper->num_blocks;
+}
+
+size_t fsck_node_count(FsckState* state, size_t block_idx) {
+    NodeBlock* block = (NodeBlock*)OUT_OFFSET(state->mapper->root, block_idx * BLOCK_SIZE);
+    return min(block->node_count, MAX_NODE_COUNT);
+}
+
+// Position of a block in the node block list, or -1 if it isn't a node block
+long fsck_node_block_ordinal(FsckState* state, size_t block_idx) {
+    size_t lo = 0;
+    size_t hi = state->node_block_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (state->node_blocks[mid] < block_idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == state->node_block_count || state->node_blocks[lo] != block_idx) return -1;
+    return lo;
+}
+
+// Maps a node offset to its index in the node bitmaps, or -1 if it doesn't point at a node slot
+long fsck_node_index(FsckState* state, NodeOffset n) {
+    size_t block_idx = n / BLOCK_SIZE;
+    size_t rel = n % BLOCK_SIZE;
+    if (n == NULL_OFF || block_idx >= state->mapper->num_blocks) return -1;
+    long ordinal = fsck_node_block_ordinal(state, block_idx);
+    if (ordinal == -1) return -1;
+    if (rel < offsetof(NodeBlock, nodes)) return -1;
+    rel -= offsetof(NodeBlock, nodes);
+    if (rel % sizeof(Node) != 0) return -1;
+    size_t slot = rel / sizeof(Node);
+    if (slot >= fsck_node_count(state, block_idx)) return -1;
+    return ordinal * MAX_NODE_COUNT + slot;
+}
+
+void fsck_push(FsckState* state, NodeOffset n) {
+    pthread_mutex_lock(&state->lock);
+    if (state->stack_len == state->stack_cap) {
+        state->stack_cap = state->stack_cap ? state->stack_cap * 2 : 256;
+        state->stack = (NodeOffset*)realloc(state->stack, state->stack_cap * sizeof(NodeOffset));
+    }
+    state->stack[state->stack_len++] = n;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void fsck_check_file(FsckState* state, Node* file, FsckReport* local) {
+    size_t expected = blocks_for_size(file->node.file.size);
+    size_t count = 0;
+    BlockOffset b = file->node.file.first_block;
+    while (b != NULL_OFF) {
+        if (!fsck_valid_block(state, b)) {
+            local->bad_offsets++;
+            break;
+        }
+        if (bitmap_test_and_set(state->used_blocks, b / BLOCK_SIZE)) {
+            local->cross_linked++;
+            break;
+        }
+        count++;
+        b = ((DataBlock*)OUT_OFFSET(state->mapper->root, b))->next_block;
+    }
+    local->data_blocks += count;
+    // write_file may leave one extra block allocated at the end of the chain
+    if (count < expected || count > expected + 1) {
+        local->bad_sizes++;
+    }
+}
+
+void fsck_check_dir(FsckState* state, NodeOffset d, FsckReport* local) {
+    Node* dir = (Node*)OUT_OFFSET(state->mapper->root, d);
+    NodeOffset c = dir->node.dir.first_child;
+    while (c != NULL_OFF) {
+        long idx = fsck_node_index(state, c);
+        if (idx == -1) {
+            local->bad_offsets++;
+            return;
+        }
+        // Also stops sibling chains that loop back on themselves
+        if (bitmap_test_and_set(state->used_nodes, idx)) {
+            local->cross_linked++;
+            return;
+        }
+        local->nodes++;
+        Node* child = (Node*)OUT_OFFSET(state->mapper->root, c);
+        if (child->parent != d) {
+            local->bad_parents++;
+        }
+        if (child->type == DIR) {
+            fsck_push(state, c);
+        } else if (child->type == FIL) {
+            if (child->node.file.size > FSCK_SPLIT_BLOCKS * MAX_DATA_CAPACITY) {
+                fsck_push(state, c);
+            } else {
+                fsck_check_file(state, child, local);
+            }
+        } else {
+            local->bad_offsets++;
+        }
+        c = child->next_sibling;
+    }
+}
+
+void fsck_merge(FsckReport* into, FsckReport* from) {
+    __atomic_fetch_add(&into->data_blocks, from->data_blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->nodes, from->nodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->bad_offsets, from->bad_offsets, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->cross_linked, from->cross_linked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->bad_parents, from->bad_parents, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->bad_sizes, from->bad_sizes, __ATOMIC_RELAXED);
+}
+
+void* fsck_worker(void* arg) {
+    FsckState* state = (FsckState*)arg;
+    FsckReport local = {0};
+    while (1) {
+        pthread_mutex_lock(&state->lock);
+        while (state->stack_len == 0 && state->active > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        if (state->stack_len == 0) {
+            pthread_cond_broadcast(&state->cond);
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        NodeOffset n = state->stack[--state->stack_len];
+        state->active++;
+        pthread_mutex_unlock(&state->lock);
+
+        Node* node = (Node*)OUT_OFFSET(state->mapper->root, n);
+        if (node->type == DIR) {
+            fsck_check_dir(state, n, &local);
+        } else {
+            fsck_check_file(state, node, &local);
+        }
+
+        pthread_mutex_lock(&state->lock);
+        state->active--;
+        if (state->stack_len == 0 && state->active == 0) {
+            pthread_cond_broadcast(&state->cond);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    fsck_merge(&state->report, &local);
+    return NULL;
+}
+
+int fsck_compare_blocks(const void* a, const void* b) {
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+void fsck_walk_lists(FsckState* state) {
+    FsckReport* report = &state->report;
+    RootNode* root = state->mapper->root;
+
+    size_t capacity = 0;
+    BlockOffset b = root->first_block;
+    while (b != NULL_OFF) {
+        if (!fsck_valid_block(state, b)) {
+            report->bad_offsets++;
+            break;
+        }
+        // Nothing else is marked yet, so a set bit means the chain loops
+        if (bitmap_test_and_set(state->used_blocks, b / BLOCK_SIZE)) {
+            report->cross_linked++;
+            break;
+        }
+        if (state->node_block_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            state->node_blocks = (size_t*)realloc(state->node_blocks, capacity * sizeof(size_t));
+        }
+        state->node_blocks[state->node_block_count++] = b / BLOCK_SIZE;
+        report->node_blocks++;
+        b = ((NodeBlock*)OUT_OFFSET(root, b))->next_block;
+    }
+    qsort(state->node_blocks, state->node_block_count, sizeof(size_t), fsck_compare_blocks);
+    state->used_nodes = new_bitmap(state->node_block_count * MAX_NODE_COUNT);
+    state->free_nodes = new_bitmap(state->node_block_count * MAX_NODE_COUNT);
+
+    b = root->first_free_block;
+    while (b != NULL_OFF) {
+        if (!fsck_valid_block(state, b)) {
+            report->bad_offsets++;
+            break;
+        }
+        if (bitmap_test_and_set(state->free_blocks, b / BLOCK_SIZE)) {
+            report->cross_linked++;
+            break;
+        }
+        report->free_blocks++;
+        b = ((EmptyBlock*)OUT_OFFSET(root, b))->next_block;
+    }
+
+    // Needs the node blocks bitmap to validate offsets
+    NodeOffset n = root->first_free_node;
+    while (n != NULL_OFF) {
+        long idx = fsck_node_index(state, n);
+        if (idx == -1) {
+            report->bad_offsets++;
+            break;
+        }
+        if (bitmap_test_and_set(state->free_nodes, idx)) {
+            report->cross_linked++;
+            break;
+        }
+        report->free_nodes++;
+        n = ((EmptyNode*)OUT_OFFSET(root, n))->next_node;
+    }
+}
+
+// Rebuilds both free lists from whatever the tree walk didn't reach, lowest offsets first
+void fsck_rebuild_free_lists(FsckState* state) {
+    RootNode* root = state->mapper->root;
+    BlockOffset first_block = NULL_OFF;
+    for (size_t i = state->mapper->num_blocks; i-- > 1;) {
+        if (bitmap_get(state->used_blocks, i)) continue;
+        EmptyBlock* block = (EmptyBlock*)OUT_OFFSET(root, i * BLOCK_SIZE);
+        block->next_block = first_block;
+        first_block = i * BLOCK_SIZE;
+    }
+    root->first_free_block = first_block;
+
+    NodeOffset first_node = NULL_OFF;
+    for (size_t o = state->node_block_count; o-- > 0;) {
+        size_t i = state->node_blocks[o];
+        NodeBlock* block = (NodeBlock*)OUT_OFFSET(root, i * BLOCK_SIZE);
+        for (size_t slot = fsck_node_count(state, i); slot-- > 0;) {
+            if (bitmap_get(state->used_nodes, o * MAX_NODE_COUNT + slot)) continue;
+            EmptyNode* node = (EmptyNode*)&block->nodes[slot];
+            node->next_node = first_node;
+            first_node = MAP_OFFSET(root, node);
+        }
+    }
+    root->first_free_node = first_node;
+}
+
+FsckReport check_fs(Mapper* mapper, int repair, size_t threads) {
+    double start = now_seconds();
+    size_t num_blocks = mapper->num_blocks;
+    FsckState state = {0};
+    state.mapper = mapper;
+    state.used_blocks = new_bitmap(num_blocks);
+    state.free_blocks = new_bitmap(num_blocks);
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    state.report.blocks = num_blocks;
+
+    fsck_walk_lists(&state);
+    // The root block is always in use
+    bitmap_test_and_set(state.used_blocks, 0);
+
+    long root_idx = fsck_node_index(&state, mapper->root->root_dir);
+    if (root_idx == -1) {
+        state.report.bad_offsets++;
+    } else {
+        bitmap_test_and_set(state.used_nodes, root_idx);
+        state.report.nodes++;
+        fsck_push(&state, mapper->root->root_dir);
+
+        if (threads < 1) threads = 1;
+        pthread_t* ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+        size_t started = 0;
+        for (; started < threads; started++) {
+            if (pthread_create(&ids[started], NULL, fsck_worker, &state) != 0) break;
+        }
+        if (started == 0) fsck_worker(&state);
+        for (size_t i = 0; i < started; i++) {
+            pthread_join(ids[i], NULL);
+        }
+        free(ids);
+    }
+
+    FsckReport* report = &state.report;
+    for (size_t i = 1; i < num_blocks; i++) {
+        int used = bitmap_get(state.used_blocks, i);
+        int on_free = bitmap_get(state.free_blocks, i);
+        if (used && on_free) report->free_in_use++;
+        if (!used && !on_free) report->leaked_blocks++;
+    }
+    for (size_t o = 0; o < state.node_block_count; o++) {
+        for (size_t slot = 0; slot < fsck_node_count(&state, state.node_blocks[o]); slot++) {
+            int used_node = bitmap_get(state.used_nodes, o * MAX_NODE_COUNT + slot);
+            int free_node = bitmap_get(state.free_nodes, o * MAX_NODE_COUNT + slot);
+            if (used_node && free_node) report->free_in_use++;
+            if (!used_node && !free_node) report->leaked_nodes++;
+        }
+    }
+
+    // With dangling offsets the walk may have missed live blocks, freeing them would lose data
+    int dirty = report->free_in_use || report->leaked_blocks || report->leaked_nodes;
+    if (repair && dirty && report->bad_offsets == 0) {
+        fsck_rebuild_free_lists(&state);
+        report->repaired = 1;
+    }
+
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+    free(state.stack);
+    free(state.used_blocks);
+    free(state.free_blocks);
+    free(state.node_blocks);
+    free(state.used_nodes);
+    free(state.free_nodes);
+    report->seconds = now_seconds() - start;
+    return *report;
+}
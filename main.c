@@ -2,18 +2,13 @@
 #include <stdio.h>
 #include <string.h>
 
-void print_node(Mapper* mapper, NodeOffset n) {
-    Node* node = OUT_OFFSET(mapper->root, n);
-    switch (node->type) {
+void print_entry(DirEntryPlus* entry) {
+    switch (entry->type) {
         case DIR:
-            if (node->parent == NULL_OFF) {
-                puts("/ dir\n");
-            } else {
-                printf("%s dir\n", node->name);
-            }
+            printf("%s dir\n", entry->name);
             break;
         case FIL:
-            printf("%s file, size %zu\n", node->name, node->node.file.size);
+            printf("%s file, size %zu\n", entry->name, entry->size);
             break;
         default:
             break;
@@ -28,14 +23,39 @@ void ls(Mapper* mapper, NodeOffset node) {
     }
     printf("Listing directory %s\n", name);
     DirIterator iter = create_iterator(mapper, node);
-    NodeOffset n;
-    while (n = iter_next(&iter), n != NULL_OFF) {
-        print_node(mapper, n);
+    char buffer[16 * 1024];
+    size_t len;
+    while (len = readdir_plus(&iter, buffer, sizeof(buffer)), len != 0) {
+        for (size_t off = 0; off < len;) {
+            DirEntryPlus* entry = (DirEntryPlus*)(buffer + off);
+            print_entry(entry);
+            off += entry->record_len;
+        }
     }
 }
 
 int validate_name(char* name) {
-    return find_char(name, '/') == -1;
+    return valid_node_name(name);
+}
+
+// Creates every name in args with a single batch, returns -1 if there were none
+int create_names(Mapper* mapper, NodeOffset dir, char* args, NodeType type) {
+    char* names[512];
+    size_t count = 0;
+    for (char* name = strtok(args, " "); name != NULL; name = strtok(NULL, " ")) {
+        if (!validate_name(name)) {
+            printf("invalid name %s\n", name);
+            return 0;
+        }
+        if (count == sizeof(names) / sizeof(names[0])) {
+            puts("too many names");
+            return 0;
+        }
+        names[count++] = name;
+    }
+    if (count == 0) return -1;
+    create_children_batch(mapper, dir, names, count, type, NULL);
+    return 0;
 }
 
 void trim_newline(char* str) {
@@ -44,8 +64,109 @@ void trim_newline(char* str) {
     str[index] = 0;
 }
 
-int main() {
-    Mapper* mapper = new_mapper("fs.img");
+void print_transfer(char* action, TransferStats stats) {
+    double mb = stats.bytes / (1024.0 * 1024.0);
+    printf("%s %zu files, %zu dirs, %.2f MB in %.3fs (%.2f MB/s)",
+            action, stats.files, stats.dirs, mb, stats.seconds,
+            stats.seconds > 0 ? mb / stats.seconds : 0.0);
+    if (stats.failed) {
+        printf(", %zu failed", stats.failed);
+    }
+    putchar('\n');
+}
+
+void print_fsck(FsckReport report) {
+    double mb = report.blocks * (double)BLOCK_SIZE / (1024.0 * 1024.0);
+    printf("checked %zu blocks (%zu node, %zu data, %zu free), %zu nodes (%zu free)\n",
+            report.blocks, report.node_blocks, report.data_blocks, report.free_blocks,
+            report.nodes, report.free_nodes);
+    printf("\tbad offsets %zu\n", report.bad_offsets);
+    printf("\tcross-linked %zu\n", report.cross_linked);
+    printf("\tfree but in use %zu\n", report.free_in_use);
+    printf("\tleaked blocks %zu\n", report.leaked_blocks);
+    printf("\tleaked nodes %zu\n", report.leaked_nodes);
+    printf("\tbad parents %zu\n", report.bad_parents);
+    printf("\tbad sizes %zu\n", report.bad_sizes);
+    if (report.repaired) {
+        puts("free lists rebuilt");
+    }
+    printf("%.2f MB in %.3fs (%.2f MB/s)\n", mb, report.seconds,
+            report.seconds > 0 ? mb / report.seconds : 0.0);
+}
+
+// Reads a whole file from a cold cache in 64 KB calls
+void bench_read(Mapper* mapper, Node* file, char* label) {
+    if (drop_cache(mapper) == -1) {
+        perror("drop_cache");
+    }
+    size_t fd = open_file(mapper, file);
+    if (fd == INVALID_FD) {
+        puts("too many open files");
+        return;
+    }
+    size_t chunk = 64 * 1024;
+    char* buffer = (char*)malloc(chunk);
+    size_t total = 0;
+    int n;
+    double start = now_seconds();
+    while (n = read_file(mapper, fd, buffer, chunk), n > 0) {
+        total += n;
+    }
+    double seconds = now_seconds() - start;
+    close_file(mapper, fd);
+    free(buffer);
+    double mb = total / (1024.0 * 1024.0);
+    printf("%s: %.2f MB in %.3fs (%.2f MB/s)\n", label, mb, seconds, seconds > 0 ? mb / seconds : 0.0);
+}
+
+// Creates count files one at a time in one new directory and as a single batch in another
+void bench_create(Mapper* mapper, NodeOffset dir, size_t count) {
+    char* dirs[] = { "createbench.single", "createbench.batch" };
+    NodeOffset targets[2];
+    if (create_children_batch(mapper, dir, dirs, 2, DIR, targets) == -1) {
+        return;
+    }
+    char** names = (char**)malloc(count * sizeof(char*));
+    for (size_t i = 0; i < count; i++) {
+        names[i] = (char*)malloc(24);
+        snprintf(names[i], 24, "f%zu", i);
+    }
+
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+        if (create_file(mapper, targets[0], names[i]) == NULL_OFF) break;
+    }
+    double single = now_seconds() - start;
+
+    start = now_seconds();
+    create_children_batch(mapper, targets[1], names, count, FIL, NULL);
+    double batch = now_seconds() - start;
+
+    printf("%zu files one at a time in %.3fs, as a batch in %.3fs\n", count, single, batch);
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+// dumb_fs [image] or dumb_fs -s stripe_unit file...
+Mapper* open_volume(int argc, char** argv) {
+    if (argc < 2) {
+        return new_mapper("fs.img");
+    }
+    if (strcmp(argv[1], "-s") != 0) {
+        return new_mapper(argv[1]);
+    }
+    size_t unit;
+    if (argc < 4 || sscanf(argv[2], "%zu", &unit) != 1) {
+        puts("usage: dumb_fs -s stripe_unit file...");
+        exit(1);
+    }
+    return new_striped_mapper(argv + 3, argc - 3, unit);
+}
+
+int main(int argc, char** argv) {
+    Mapper* mapper = open_volume(argc, argv);
     NodeOffset cwd = mapper->root->root_dir;
 
     char line[1024];
@@ -53,11 +174,11 @@ int main() {
         if (fgets(line, sizeof(line), stdin)) {
             trim_newline(line);
             if (strncmp(line, "lsof", 4) == 0) {
-                for (size_t i = 0; i <= MAX_FD; i++) {
-                    FD entry = mapper->fd_table[i];
+                for (size_t i = 0; i < mapper->fd_table.count; i++) {
+                    FD entry = mapper->fd_table.entries[i];
                     if (entry.in_use) {
                         Node* file = (Node*)OUT_OFFSET(mapper->root, entry.file);
-                        printf("%zu -> %s\n", i, file->name);
+                        printf("%zu -> %s\n", fd_handle(&mapper->fd_table, i), file->name);
                     }
                 }
             } else if (strncmp(line, "lsfree", 6) == 0) {
@@ -91,27 +212,13 @@ int main() {
                     printf("path %s not found\n", path);
                 }
             } else if (strncmp(line, "mkdir", 5) == 0) {
-                char name[MAX_NAME_LENGTH];
-                if (sscanf(line, "mkdir %s", name) != 1) {
+                if (create_names(mapper, cwd, line + 5, DIR) == -1) {
                     puts("invalid use of mkdir");
-                    continue;
-                }
-                if (!validate_name(name)) {
-                    printf("invalid name %s\n", name);
-                    continue;
                 }
-                create_dir(mapper, cwd, name);
             } else if (strncmp(line, "touch", 5) == 0) {
-                char name[MAX_NAME_LENGTH];
-                if (sscanf(line, "touch %s", name) != 1) {
+                if (create_names(mapper, cwd, line + 5, FIL) == -1) {
                     puts("invalid use of touch");
-                    continue;
-                }
-                if (!validate_name(name)) {
-                    printf("invalid name %s\n", name);
-                    continue;
                 }
-                create_file(mapper, cwd, name);
             } else if (strncmp(line, "open", 4) == 0) {
                 char path[256];
                 if (sscanf(line, "open %s", path) != 1) {
@@ -129,49 +236,115 @@ int main() {
                     continue;
                 }
                 size_t fd = open_file(mapper, n);
+                if (fd == INVALID_FD) {
+                    puts("too many open files");
+                    continue;
+                }
                 printf("opened with fd %zu\n", fd);
             } else if (strncmp(line, "close", 5) == 0) {
-                int fd;
-                if (sscanf(line, "close %d", &fd) != 1) {
+                size_t fd;
+                if (sscanf(line, "close %zu", &fd) != 1) {
                     puts("invalid use of close");
                     continue;
                 }
-                FD* entry = &mapper->fd_table[fd];
-                if (!entry->in_use) {
-                    printf("file descriptor %d is not being used", fd);
+                if (close_file(mapper, fd) == -1) {
+                    printf("file descriptor %zu is not being used\n", fd);
+                }
+            } else if (strncmp(line, "createbench", 11) == 0) {
+                size_t count;
+                if (sscanf(line, "createbench %zu", &count) != 1 || count == 0) {
+                    puts("invalid use of createbench");
+                    continue;
+                }
+                bench_create(mapper, cwd, count);
+            } else if (strncmp(line, "readahead", 9) == 0) {
+                char mode[4];
+                if (sscanf(line, "readahead %3s", mode) != 1) {
+                    puts("invalid use of readahead");
+                } else if (strcmp(mode, "on") == 0) {
+                    mapper->readahead = 1;
+                } else if (strcmp(mode, "off") == 0) {
+                    mapper->readahead = 0;
+                } else {
+                    puts("invalid use of readahead");
+                }
+            } else if (strncmp(line, "readbench", 9) == 0) {
+                char path[256];
+                if (sscanf(line, "readbench %255s", path) != 1) {
+                    puts("invalid use of readbench");
+                    continue;
+                }
+                NodeOffset offset = traverse_path(mapper, cwd, path);
+                if (offset == NULL_OFF || ((Node*)OUT_OFFSET(mapper->root, offset))->type != FIL) {
+                    printf("file %s doesn't exist\n", path);
+                    continue;
+                }
+                int readahead = mapper->readahead;
+                mapper->readahead = 0;
+                bench_read(mapper, (Node*)OUT_OFFSET(mapper->root, offset), "cold, no readahead");
+                mapper->readahead = 1;
+                bench_read(mapper, (Node*)OUT_OFFSET(mapper->root, offset), "cold, readahead");
+                mapper->readahead = readahead;
+            } else if (strncmp(line, "hint", 4) == 0) {
+                char name[16];
+                int hint;
+                if (sscanf(line, "hint %15s", name) != 1) {
+                    puts("invalid use of hint");
                     continue;
                 }
-                close_file(mapper, fd);
+                if (strcmp(name, "metadata") == 0) {
+                    hint = MAPPING_HINT_METADATA;
+                } else if (strcmp(name, "populate") == 0) {
+                    hint = MAPPING_HINT_POPULATE;
+                } else if (strcmp(name, "hugepages") == 0) {
+                    hint = MAPPING_HINT_HUGEPAGES;
+                } else {
+                    printf("unknown hint %s\n", name);
+                    continue;
+                }
+                if (set_mapping_hints(mapper, mapper->hints | hint) == -1) {
+                    perror("madvise");
+                }
             } else if (strncmp(line, "read", 4) == 0) {
                 char buffer[1024];
-                int fd;
+                size_t fd;
                 int size;
-                if (sscanf(line, "read %d %d", &fd, &size) != 2) {
+                if (sscanf(line, "read %zu %d", &fd, &size) != 2 || size < 0) {
                     puts("invalid use of read");
                     continue;
                 }
                 if (size >= 1024) {
                     puts("too large");
+                    continue;
                 }
                 int read = read_file(mapper, fd, buffer, size);
+                if (read == -1) {
+                    printf("file descriptor %zu is not being used\n", fd);
+                    continue;
+                }
                 buffer[read] = 0;
                 printf("Read %d bytes:\n%s\n", read, buffer);
             } else if (strncmp(line, "write", 5) == 0) {
                 char buffer[1024] = {0};
-                int fd;
-                if (sscanf(line, "write %d %1023s", &fd, buffer) != 2) {
+                size_t fd;
+                if (sscanf(line, "write %zu %1023s", &fd, buffer) != 2) {
                     puts("invalid use of write");
                     continue;
                 }
                 int len = strlen(buffer);
                 int written = write_file(mapper, fd, buffer, len);
+                if (written == -1) {
+                    // Otherwise the volume is full and grow_blocks already said so
+                    if (get_fd(mapper, fd) == NULL) printf("file descriptor %zu is not being used\n", fd);
+                    continue;
+                }
                 printf("wrote %d bytes\n", written);
             } else if (strncmp(line, "seek", 4) == 0) {
                 char buffer[4];
-                int fd;
+                size_t fd;
                 int offset;
                 int flag;
-                if (sscanf(line, "seek %d %d %3s", &fd, &offset, buffer) != 3) {
+                if (sscanf(line, "seek %zu %d %3s", &fd, &offset, buffer) != 3) {
                     puts("invalid use of seek");
                     continue;
                 }
@@ -185,7 +358,9 @@ int main() {
                     puts("invalid seek flag");
                     continue;
                 }
-                seek_file(mapper, fd, offset, flag);
+                if (seek_file(mapper, fd, offset, flag) == -1) {
+                    printf("file descriptor %zu is not being used\n", fd);
+                }
             } else if (strncmp(line, "rm", 2) == 0) {
                 char path[256];
                 if (sscanf(line, "rm %s", path) != 1) {
@@ -202,6 +377,35 @@ int main() {
                 } else {
                     printf("couldn't delete file %s\n", path);
                 }
+            } else if (strncmp(line, "import", 6) == 0) {
+                char path[256];
+                size_t threads = default_thread_count();
+                if (sscanf(line, "import %255s %zu", path, &threads) < 1 || threads == 0) {
+                    puts("invalid use of import");
+                    continue;
+                }
+                print_transfer("imported", import_tree(mapper, cwd, path, threads));
+            } else if (strncmp(line, "export", 6) == 0) {
+                char path[256];
+                size_t threads = default_thread_count();
+                if (sscanf(line, "export %255s %zu", path, &threads) < 1 || threads == 0) {
+                    puts("invalid use of export");
+                    continue;
+                }
+                print_transfer("exported", export_tree(mapper, cwd, path, threads));
+            } else if (strncmp(line, "fsck", 4) == 0) {
+                char mode[8] = {0};
+                size_t threads = default_thread_count();
+                int repair = 0;
+                if (sscanf(line, "fsck %7s %zu", mode, &threads) >= 1) {
+                    if (strcmp(mode, "repair") == 0) {
+                        repair = 1;
+                    } else if (sscanf(mode, "%zu", &threads) != 1) {
+                        puts("invalid use of fsck");
+                        continue;
+                    }
+                }
+                print_fsck(check_fs(mapper, repair, threads));
             } else if (strncmp(line, "exit", 4) == 0) {
                 return 0;
             } else {